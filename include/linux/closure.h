@@ -3,7 +3,9 @@
 #define _LINUX_CLOSURE_H
 
 #include <linux/llist.h>
+#include <linux/percpu.h>
 #include <linux/sched.h>
+#include <linux/sched/clock.h>
 #include <linux/sched/task_stack.h>
 #include <linux/workqueue.h>
 
@@ -154,6 +156,7 @@ struct closure {
 	struct closure		*parent;
 
 	atomic_t		remaining;
+	bool			run_inline;
 
 #ifdef CONFIG_DEBUG_CLOSURES
 #define CLOSURE_MAGIC_DEAD	0xc054dead
@@ -163,6 +166,10 @@ struct closure {
 	struct list_head	all;
 	unsigned long		ip;
 	unsigned long		waiting_on;
+
+	/* see closure_stage_time(): */
+	u64			wait_start;
+	u64			queue_start;
 #endif
 };
 
@@ -217,21 +224,102 @@ static inline void closure_set_waiting(struct closure *cl, unsigned long f)
 #endif
 }
 
+static inline void closure_set_wait_start(struct closure *cl)
+{
+#ifdef CONFIG_DEBUG_CLOSURES
+	cl->wait_start = local_clock();
+#endif
+}
+
+static inline void closure_set_queue_start(struct closure *cl)
+{
+#ifdef CONFIG_DEBUG_CLOSURES
+	cl->queue_start = local_clock();
+#endif
+}
+
+struct closure_stage_time {
+	/* from continue_at() until the last ref was put, e.g. waiting on IO: */
+	u64			waiting;
+	/* from the last ref being put until now, e.g. queued on a workqueue: */
+	u64			queued;
+};
+
+/**
+ * closure_stage_time - where the time went getting to the current closure_fn
+ *
+ * Meant to be called at the start of a closure_fn, to account the latency of
+ * each stage of a closure chain; time spent running is then whatever the
+ * closure_fn measures until its next continue_at().
+ *
+ * Only tracked with CONFIG_DEBUG_CLOSURES, otherwise returns zeroes.
+ */
+static inline struct closure_stage_time closure_stage_time(struct closure *cl)
+{
+	struct closure_stage_time ret = { 0 };
+#ifdef CONFIG_DEBUG_CLOSURES
+	u64 now = local_clock();
+
+	if (cl->wait_start &&
+	    cl->queue_start >= cl->wait_start &&
+	    now >= cl->queue_start) {
+		ret.waiting	= cl->queue_start - cl->wait_start;
+		ret.queued	= now - cl->queue_start;
+	}
+#endif
+	return ret;
+}
+
 static inline void closure_set_stopped(struct closure *cl)
 {
 	atomic_sub(CLOSURE_RUNNING, &cl->remaining);
 }
 
-static inline void set_closure_fn(struct closure *cl, closure_fn *fn,
-				  struct workqueue_struct *wq)
+static inline void __set_closure_fn(struct closure *cl, closure_fn *fn,
+				    struct workqueue_struct *wq,
+				    bool run_inline)
 {
 	closure_set_ip(cl);
+	closure_set_wait_start(cl);
 	cl->fn = fn;
 	cl->wq = wq;
+	cl->run_inline = run_inline;
 	/* between atomic_dec() in closure_put() */
 	smp_mb__before_atomic();
 }
 
+static inline void set_closure_fn(struct closure *cl, closure_fn *fn,
+				  struct workqueue_struct *wq)
+{
+	__set_closure_fn(cl, fn, wq, false);
+}
+
+/*
+ * For continue_at_inline(): we can skip the workqueue if we're not in hardirq
+ * context, and if we're on the task stack with at least half of it left -
+ * closure chains can be arbitrarily long, and each closure_fn run inline nests
+ * another closure_put() on the stack.
+ *
+ * Softirqs and interrupts usually run on a separate, smaller per-cpu stack, where
+ * comparing against end_of_stack(current) would be meaningless; we don't run
+ * inline there:
+ */
+static inline bool closure_can_run_inline(void)
+{
+	unsigned long sp = (unsigned long) __builtin_frame_address(0);
+	unsigned long end = (unsigned long) end_of_stack(current);
+
+	if (in_hardirq() ||
+	    !object_is_on_stack((void *) sp))
+		return false;
+
+#ifdef CONFIG_STACK_GROWSUP
+	return end - sp > THREAD_SIZE / 2;
+#else
+	return sp - end > THREAD_SIZE / 2;
+#endif
+}
+
 static inline void closure_queue(struct closure *cl)
 {
 	struct workqueue_struct *wq = cl->wq;
@@ -242,7 +330,9 @@ static inline void closure_queue(struct closure *cl)
 	BUILD_BUG_ON(offsetof(struct closure, fn)
 		     != offsetof(struct work_struct, func));
 
-	if (wq) {
+	closure_set_queue_start(cl);
+
+	if (wq && !(cl->run_inline && closure_can_run_inline())) {
 		INIT_WORK(&cl->work, cl->work.func);
 		BUG_ON(!queue_work(wq, &cl->work));
 	} else
@@ -279,6 +369,10 @@ static inline void closure_init(struct closure *cl, struct closure *parent)
 
 	closure_debug_create(cl);
 	closure_set_ip(cl);
+#ifdef CONFIG_DEBUG_CLOSURES
+	cl->wait_start	= 0;
+	cl->queue_start	= 0;
+#endif
 }
 
 static inline void closure_init_stack(struct closure *cl)
@@ -298,6 +392,70 @@ static inline void closure_wake_up(struct closure_waitlist *list)
 	__closure_wake_up(list);
 }
 
+/*
+ * Percpu waitlists:
+ *
+ * Every closure_wait() on a closure_waitlist is an atomic op on the same
+ * cacheline; for hot waitlists, waiters can instead add themselves to a list
+ * for the cpu they're running on. Waking up then costs a pass over every cpu's
+ * list, but lists that are empty are skipped without being written to, and
+ * nonempty lists are woken as a batch.
+ *
+ * The usual waitlist ordering rules apply: the waker must make the condition
+ * waiters are waiting on visible before closure_wake_up_pcpu() (which has the
+ * barrier), and waiters must recheck the condition after closure_wait_pcpu().
+ */
+struct closure_waitlist_pcpu {
+	struct closure_waitlist __percpu	*lists;
+};
+
+static inline int closure_waitlist_pcpu_init(struct closure_waitlist_pcpu *w)
+{
+	w->lists = alloc_percpu(struct closure_waitlist);
+	return w->lists ? 0 : -ENOMEM;
+}
+
+static inline void closure_waitlist_pcpu_exit(struct closure_waitlist_pcpu *w)
+{
+	free_percpu(w->lists);
+	w->lists = NULL;
+}
+
+/**
+ * closure_wait_pcpu - add a closure to a percpu waitlist
+ *
+ * Like closure_wait(); the list for the current cpu is only a locality hint,
+ * so it's fine if we're migrated afterwards.
+ */
+static inline bool closure_wait_pcpu(struct closure_waitlist_pcpu *w,
+				     struct closure *cl)
+{
+	return closure_wait(raw_cpu_ptr(w->lists), cl);
+}
+
+static inline void __closure_wake_up_pcpu(struct closure_waitlist_pcpu *w)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct closure_waitlist *list = per_cpu_ptr(w->lists, cpu);
+
+		if (!llist_empty(&list->list))
+			__closure_wake_up(list);
+	}
+}
+
+/**
+ * closure_wake_up_pcpu - wake up all closures on a percpu wait list,
+ *			  with memory barrier
+ */
+static inline void closure_wake_up_pcpu(struct closure_waitlist_pcpu *w)
+{
+	/* Memory barrier for the wait list */
+	smp_mb();
+	__closure_wake_up_pcpu(w);
+}
+
 /**
  * continue_at - jump to another function with barrier
  *
@@ -317,6 +475,24 @@ do {									\
 	closure_sub(_cl, CLOSURE_RUNNING + 1);				\
 } while (0)
 
+/**
+ * continue_at_inline - jump to another function, running it inline if possible
+ *
+ * Like continue_at(), except when the last ref on @cl is dropped, @fn will be
+ * called directly by closure_put() if that's safe - running on the task stack
+ * (not in hardirq context, and not on a separate softirq/irq stack), with
+ * enough of it left - and will only be punted to @wq otherwise.
+ *
+ * This saves a workqueue hop, but it means @fn must be fine running in whatever
+ * context the final closure_put() happens in - e.g. softirq context, when bio
+ * completions run on the task stack - so @fn must not sleep.
+ */
+#define continue_at_inline(_cl, _fn, _wq)				\
+do {									\
+	__set_closure_fn(_cl, _fn, _wq, true);				\
+	closure_sub(_cl, CLOSURE_RUNNING + 1);				\
+} while (0)
+
 /**
  * closure_return - finish execution of a closure
  *
@@ -26,6 +26,9 @@
  *
  * - genradix_for_each(radix, iter, p) - iterate over each entry in a genradix
  *
+ * - genradix_for_each_range(radix, iter, p, nr) - iterate over contiguous runs
+ *   of entries in a genradix, one leaf page at a time
+ *
  * The radix tree allocates one page of entries at a time, so entries may exist
  * that were never explicitly allocated - they will be initialized to all
  * zeroes.
@@ -262,6 +265,50 @@ static inline void __genradix_iter_rewind(struct genradix_iter *iter,
 #define genradix_for_each(_radix, _iter, _p)			\
 	genradix_for_each_from(_radix, _iter, _p, 0)
 
+static inline size_t __genradix_iter_range_nr(struct genradix_iter *iter,
+					       size_t objs_per_page)
+{
+	return objs_per_page - iter->pos % objs_per_page;
+}
+
+static inline void __genradix_iter_advance_range(struct genradix_iter *iter,
+						 size_t nr)
+{
+	size_t next = round_down(iter->offset, PAGE_SIZE) + PAGE_SIZE;
+
+	if (next < iter->offset) {
+		iter->offset	= SIZE_MAX;
+		iter->pos	= SIZE_MAX;
+		return;
+	}
+
+	iter->offset	= next;
+	iter->pos	+= nr;
+}
+
+#define genradix_for_each_range_from(_radix, _iter, _p, _nr, _start)	\
+	for (_iter = genradix_iter_init(_radix, _start);		\
+	     (_p = genradix_iter_peek(&_iter, _radix)) != NULL &&	\
+	     ((_nr = __genradix_iter_range_nr(&_iter,			\
+				__genradix_objs_per_page(_radix))), true);\
+	     __genradix_iter_advance_range(&_iter, _nr))
+
+/**
+ * genradix_for_each_range - iterate over contiguous runs of entries in a
+ *			     genradix
+ * @_radix:	genradix to iterate over
+ * @_iter:	a genradix_iter to track current position
+ * @_p:		pointer to genradix entry type
+ * @_nr:	number of entries in the current run
+ *
+ * Like genradix_for_each(), but hands out a leaf page's worth of entries at a
+ * time: on every iteration, @_p[0] through @_p[@_nr - 1] are valid, and
+ * @_iter.pos is the index of @_p[0]. This avoids a radix tree walk per entry
+ * when scanning or bulk updating large tables.
+ */
+#define genradix_for_each_range(_radix, _iter, _p, _nr)		\
+	genradix_for_each_range_from(_radix, _iter, _p, _nr, 0)
+
 #define genradix_last_pos(_radix)				\
 	(SIZE_MAX / PAGE_SIZE * __genradix_objs_per_page(_radix) - 1)
 
@@ -2,6 +2,7 @@
 #ifndef MEAN_AND_VARIANCE_H_
 #define MEAN_AND_VARIANCE_H_
 
+#include <linux/bug.h>
 #include <linux/types.h>
 #include <linux/limits.h>
 #include <linux/math64.h>
@@ -198,6 +199,8 @@ mean_and_variance_weighted_update_inlined(struct mean_and_variance_weighted s1,
 }
 
 struct mean_and_variance mean_and_variance_update(struct mean_and_variance s1, s64 v1);
+struct mean_and_variance mean_and_variance_update_batch(struct mean_and_variance s1,
+							 const s64 *v, unsigned nr);
        s64		 mean_and_variance_get_mean(struct mean_and_variance s);
        u64		 mean_and_variance_get_variance(struct mean_and_variance s1);
        u32		 mean_and_variance_get_stddev(struct mean_and_variance s);
@@ -207,4 +210,42 @@ struct mean_and_variance_weighted mean_and_variance_weighted_update(struct mean_
        u64			  mean_and_variance_weighted_get_variance(struct mean_and_variance_weighted s);
        u32			  mean_and_variance_weighted_get_stddev(struct mean_and_variance_weighted s);
 
+/*
+ * Buffered updates: samples are collected in a (typically percpu) buffer and
+ * folded in with mean_and_variance_update_batch() when it fills up, so the
+ * shared mean_and_variance is only touched once per batch. The caller provides
+ * whatever locking the shared mean_and_variance needs around
+ * mean_and_variance_buf_flush().
+ *
+ * The buffer itself is not safe against concurrent updates: with a percpu
+ * buffer, the caller must have preemption disabled from
+ * mean_and_variance_buf_add() through the flush it asks for.
+ */
+#define MEAN_AND_VARIANCE_BUF_NR	16
+
+struct mean_and_variance_buf {
+	unsigned	nr;
+	s64		v[MEAN_AND_VARIANCE_BUF_NR];
+};
+
+static inline void mean_and_variance_buf_flush(struct mean_and_variance *s,
+					       struct mean_and_variance_buf *b)
+{
+	*s = mean_and_variance_update_batch(*s, b->v, b->nr);
+	b->nr = 0;
+}
+
+/*
+ * Returns true if the buffer is full and must be flushed before the next add;
+ * if it wasn't, the sample is dropped rather than overrunning the buffer:
+ */
+static inline bool mean_and_variance_buf_add(struct mean_and_variance_buf *b, s64 v)
+{
+	if (WARN_ON_ONCE(b->nr >= MEAN_AND_VARIANCE_BUF_NR))
+		return true;
+
+	b->v[b->nr++] = v;
+	return b->nr == MEAN_AND_VARIANCE_BUF_NR;
+}
+
 #endif // MEAN_AND_VAIRANCE_H_
@@ -40,6 +40,15 @@
  * use six_relock_(read|intent_write)(lock, seq) to attempt to retake the lock
  * iff it hasn't been locked for write in the meantime.
  *
+ * The sequence number can also be used for lockless, seqlock style reads of
+ * whatever the lock protects, provided the memory itself can't go away (e.g.
+ * it's freed with RCU):
+ *
+ * seq = six_lock_seq_begin(&foo->lock);
+ * ... read foo ...
+ * if (six_lock_seq_retry(&foo->lock, seq))
+ *	... fall back to six_lock_read(), or six_relock_read(&foo->lock, seq) ...
+ *
  * There are also operations that take the lock type as a parameter, where the
  * type is one of SIX_LOCK_read, SIX_LOCK_intent, or SIX_LOCK_write:
  *
@@ -107,6 +116,7 @@ struct six_lock {
 	struct task_struct	*owner;
 	unsigned __percpu	*readers;
 	unsigned		intent_lock_recurse;
+	unsigned		read_contended;
 	raw_spinlock_t		wait_lock;
 	struct list_head	wait_list;
 #ifdef CONFIG_DEBUG_LOCK_ALLOC
@@ -129,6 +139,7 @@ static __always_inline void __six_lock_init(struct six_lock *lock,
 					    struct lock_class_key *key)
 {
 	atomic64_set(&lock->state.counter, 0);
+	lock->read_contended = 0;
 	raw_spin_lock_init(&lock->wait_lock);
 	INIT_LIST_HEAD(&lock->wait_list);
 #ifdef CONFIG_DEBUG_LOCK_ALLOC
@@ -200,6 +211,38 @@ static inline void six_unlock_type(struct six_lock *lock, enum six_lock_type typ
 	SIX_LOCK_DISPATCH(type, six_unlock, lock);
 }
 
+/**
+ * six_lock_seq_begin - begin a lockless read section
+ * @lock:	lock protecting the data to be read
+ *
+ * Returns the current sequence number, for six_lock_seq_retry(). If a write
+ * lock is currently held the returned sequence number is odd, and the read will
+ * always fail validation - callers may want to check for that and take the lock
+ * right away instead of reading anything.
+ */
+static inline u32 six_lock_seq_begin(const struct six_lock *lock)
+{
+	u32 seq = READ_ONCE(lock->state.seq);
+
+	smp_rmb();
+	return seq;
+}
+
+/**
+ * six_lock_seq_retry - end a lockless read section
+ * @lock:	lock protecting the data that was read
+ * @seq:	sequence number from six_lock_seq_begin()
+ *
+ * Returns true if the lock was held for write at any point since
+ * six_lock_seq_begin(), meaning what was read may be inconsistent and must be
+ * discarded.
+ */
+static inline bool six_lock_seq_retry(const struct six_lock *lock, u32 seq)
+{
+	smp_rmb();
+	return (seq & 1) || READ_ONCE(lock->state.seq) != seq;
+}
+
 void six_lock_downgrade(struct six_lock *);
 bool six_lock_tryupgrade(struct six_lock *);
 bool six_trylock_convert(struct six_lock *, enum six_lock_type,
@@ -211,6 +254,7 @@ void six_lock_wakeup_all(struct six_lock *);
 
 void six_lock_pcpu_free(struct six_lock *);
 void six_lock_pcpu_alloc(struct six_lock *);
+void six_lock_pcpu_adapt(struct six_lock *);
 
 struct six_lock_count {
 	unsigned n[3];
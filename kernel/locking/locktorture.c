@@ -83,6 +83,7 @@ struct lock_torture_ops {
 	int (*readlock)(int tid);
 	void (*read_delay)(struct torture_random_state *trsp);
 	void (*readunlock)(int tid);
+	void (*stats)(void);
 
 	unsigned long flags; /* for irq spinlocks */
 	const char *name;
@@ -660,6 +661,241 @@ static struct lock_torture_ops percpu_rwsem_lock_ops = {
 	.name		= "percpu_rwsem_lock"
 };
 
+#ifdef CONFIG_SIXLOCKS
+#include <linux/six.h>
+#include <linux/sched/clock.h>
+
+static struct six_lock torture_six;
+static bool torture_six_adaptive;
+static unsigned long torture_six_start;
+
+/*
+ * Per thread state and statistics, so that the harness itself doesn't add
+ * shared cachelines for the lock types being compared to bounce:
+ */
+struct torture_six_thread {
+	u32		seq;
+	bool		seq_valid;
+	/* indexed by enum six_lock_type: */
+	long		acquired[3];
+	u64		wait_ns[3];
+	long		relocked;
+} ____cacheline_aligned_in_smp;
+
+static struct torture_six_thread *torture_six_writers;
+static struct torture_six_thread *torture_six_readers;
+static int torture_six_nr_writers;
+static int torture_six_nr_readers;
+
+static void torture_six_init(void)
+{
+	six_lock_init(&torture_six);
+	torture_six_start = jiffies;
+
+	/*
+	 * Called before the number of readers is final - it's at most
+	 * nrealwriters_stress unless explicitly specified:
+	 */
+	torture_six_nr_writers = cxt.nrealwriters_stress;
+	torture_six_nr_readers = nreaders_stress >= 0
+		? nreaders_stress : cxt.nrealwriters_stress;
+
+	torture_six_writers = kcalloc(torture_six_nr_writers,
+				      sizeof(*torture_six_writers), GFP_KERNEL);
+	torture_six_readers = kcalloc(torture_six_nr_readers,
+				      sizeof(*torture_six_readers), GFP_KERNEL);
+	if ((torture_six_nr_writers && !torture_six_writers) ||
+	    (torture_six_nr_readers && !torture_six_readers)) {
+		pr_alert("six_lock: Out of memory for statistics, not collecting them\n");
+		kfree(torture_six_writers);
+		kfree(torture_six_readers);
+		torture_six_writers = NULL;
+		torture_six_readers = NULL;
+		torture_six_nr_writers = 0;
+		torture_six_nr_readers = 0;
+	}
+}
+
+static void torture_six_pcpu_init(void)
+{
+	torture_six_init();
+	six_lock_pcpu_alloc(&torture_six);
+	if (!torture_six.readers)
+		pr_alert("six_lock_pcpu: Out of memory for percpu reader counts, testing without\n");
+}
+
+static void torture_six_adaptive_init(void)
+{
+	torture_six_init();
+	torture_six_adaptive = true;
+}
+
+static void torture_six_exit(void)
+{
+	six_lock_pcpu_free(&torture_six);
+	kfree(torture_six_writers);
+	kfree(torture_six_readers);
+	torture_six_writers = NULL;
+	torture_six_readers = NULL;
+	torture_six_nr_writers = 0;
+	torture_six_nr_readers = 0;
+}
+
+static inline struct torture_six_thread *
+torture_six_thread(struct torture_six_thread *threads, int nr, int tid)
+{
+	return tid < nr ? threads + tid : NULL;
+}
+
+static void torture_six_lock(struct torture_six_thread *t,
+			     enum six_lock_type type)
+{
+	u64 start = t ? local_clock() : 0;
+
+	six_lock_type(&torture_six, type, NULL, NULL);
+
+	if (t) {
+		t->wait_ns[type] += local_clock() - start;
+		t->acquired[type]++;
+	}
+}
+
+static int torture_six_write_lock(int tid)
+__acquires(torture_six)
+{
+	struct torture_six_thread *t =
+		torture_six_thread(torture_six_writers, torture_six_nr_writers, tid);
+
+	/*
+	 * Take intent first, and hold it for a moment before upgrading to
+	 * write: readers may still come and go while only intent is held.
+	 */
+	torture_six_lock(t, SIX_LOCK_intent);
+	if (!(tid & 1))
+		udelay(1);
+	torture_six_lock(t, SIX_LOCK_write);
+
+	if (torture_six_adaptive)
+		six_lock_pcpu_adapt(&torture_six);
+	return 0;
+}
+
+static void torture_six_write_unlock(int tid __maybe_unused)
+__releases(torture_six)
+{
+	six_unlock_write(&torture_six);
+	six_unlock_intent(&torture_six);
+}
+
+static int torture_six_read_lock(int tid)
+__acquires(torture_six)
+{
+	struct torture_six_thread *t =
+		torture_six_thread(torture_six_readers, torture_six_nr_readers, tid);
+
+	/*
+	 * Try to relock with the sequence number this reader saw last time, as
+	 * btree node relocking does; fall back to a normal read lock if there
+	 * has been a write in the meantime:
+	 */
+	if (t && t->seq_valid &&
+	    six_relock_read(&torture_six, t->seq)) {
+		t->relocked++;
+		t->acquired[SIX_LOCK_read]++;
+		return 0;
+	}
+
+	torture_six_lock(t, SIX_LOCK_read);
+	return 0;
+}
+
+static void torture_six_read_unlock(int tid)
+__releases(torture_six)
+{
+	struct torture_six_thread *t =
+		torture_six_thread(torture_six_readers, torture_six_nr_readers, tid);
+
+	if (t) {
+		t->seq		= READ_ONCE(torture_six.state.seq);
+		t->seq_valid	= true;
+	}
+	six_unlock_read(&torture_six);
+}
+
+static void torture_six_stats(void)
+{
+	unsigned long secs = max(1UL, (jiffies - torture_six_start) / HZ);
+	static const char * const names[] = { "read", "intent", "write" };
+	long acquired[3] = { 0 }, relocked = 0;
+	u64 wait_ns[3] = { 0 };
+	int i, j;
+
+	for (i = 0; i < torture_six_nr_writers; i++)
+		for (j = 0; j < ARRAY_SIZE(names); j++) {
+			acquired[j]	+= data_race(torture_six_writers[i].acquired[j]);
+			wait_ns[j]	+= data_race(torture_six_writers[i].wait_ns[j]);
+		}
+
+	for (i = 0; i < torture_six_nr_readers; i++) {
+		for (j = 0; j < ARRAY_SIZE(names); j++) {
+			acquired[j]	+= data_race(torture_six_readers[i].acquired[j]);
+			wait_ns[j]	+= data_race(torture_six_readers[i].wait_ns[j]);
+		}
+		relocked += data_race(torture_six_readers[i].relocked);
+	}
+
+	for (j = 0; j < ARRAY_SIZE(names); j++)
+		pr_alert("six %-6s: acquired %ld (%lu/sec)  avg wait %llu ns\n",
+			 names[j], acquired[j], acquired[j] / secs,
+			 acquired[j] ? div64_u64(wait_ns[j], acquired[j]) : 0);
+
+	pr_alert("six relock: %ld  percpu readers: %s\n",
+		 relocked, READ_ONCE(torture_six.readers) ? "yes" : "no");
+}
+
+static struct lock_torture_ops six_lock_ops = {
+	.init		= torture_six_init,
+	.exit		= torture_six_exit,
+	.writelock	= torture_six_write_lock,
+	.write_delay	= torture_rwsem_write_delay,
+	.task_boost     = torture_boost_dummy,
+	.writeunlock	= torture_six_write_unlock,
+	.readlock       = torture_six_read_lock,
+	.read_delay     = torture_rwsem_read_delay,
+	.readunlock     = torture_six_read_unlock,
+	.stats		= torture_six_stats,
+	.name		= "six_lock"
+};
+
+static struct lock_torture_ops six_lock_pcpu_ops = {
+	.init		= torture_six_pcpu_init,
+	.exit		= torture_six_exit,
+	.writelock	= torture_six_write_lock,
+	.write_delay	= torture_rwsem_write_delay,
+	.task_boost     = torture_boost_dummy,
+	.writeunlock	= torture_six_write_unlock,
+	.readlock       = torture_six_read_lock,
+	.read_delay     = torture_rwsem_read_delay,
+	.readunlock     = torture_six_read_unlock,
+	.stats		= torture_six_stats,
+	.name		= "six_lock_pcpu"
+};
+
+static struct lock_torture_ops six_lock_adaptive_ops = {
+	.init		= torture_six_adaptive_init,
+	.exit		= torture_six_exit,
+	.writelock	= torture_six_write_lock,
+	.write_delay	= torture_rwsem_write_delay,
+	.task_boost     = torture_boost_dummy,
+	.writeunlock	= torture_six_write_unlock,
+	.readlock       = torture_six_read_lock,
+	.read_delay     = torture_rwsem_read_delay,
+	.readunlock     = torture_six_read_unlock,
+	.stats		= torture_six_stats,
+	.name		= "six_lock_adaptive"
+};
+#endif
+
 /*
  * Lock torture writer kthread.  Repeatedly acquires and releases
  * the lock, checking for duplicate acquisitions.
@@ -804,6 +1040,9 @@ static void lock_torture_stats_print(void)
 		pr_alert("%s", buf);
 		kfree(buf);
 	}
+
+	if (cxt.cur_ops->stats)
+		cxt.cur_ops->stats();
 }
 
 /*
@@ -912,6 +1151,11 @@ static int __init lock_torture_init(void)
 #endif
 		&rwsem_lock_ops,
 		&percpu_rwsem_lock_ops,
+#ifdef CONFIG_SIXLOCKS
+		&six_lock_ops,
+		&six_lock_pcpu_ops,
+		&six_lock_adaptive_ops,
+#endif
 	};
 
 	if (!torture_init_begin(torture_type, verbose))
@@ -8,6 +8,7 @@
 #include <linux/sched.h>
 #include <linux/sched/clock.h>
 #include <linux/sched/rt.h>
+#include <linux/sched/wake_q.h>
 #include <linux/six.h>
 #include <linux/slab.h>
 
@@ -92,6 +93,19 @@ static inline unsigned pcpu_read_count(struct six_lock *lock)
 	return read_count;
 }
 
+/* Contended reads per write at which six_lock_pcpu_adapt() goes percpu: */
+#define SIX_LOCK_PCPU_CONTENDED		32
+
+/*
+ * Contention hint for six_lock_pcpu_adapt(): this doesn't need to be exact, so
+ * it's not an atomic - we only touch it when we're already bouncing the lock's
+ * cacheline around:
+ */
+static inline void six_lock_read_contended(struct six_lock *lock)
+{
+	WRITE_ONCE(lock->read_contended, READ_ONCE(lock->read_contended) + 1);
+}
+
 /* This is probably up there with the more evil things I've done */
 #define waitlist_bitnr(id) ilog2((((union six_lock_state) { .waiters = 1 << (id) }).l))
 
@@ -102,9 +116,11 @@ static int __do_six_trylock_type(struct six_lock *lock,
 {
 	const struct six_lock_vals l[] = LOCK_VALS;
 	union six_lock_state old, new;
+	unsigned __percpu *readers;
 	int ret;
 	u64 v;
 
+retry:
 	EBUG_ON(type == SIX_LOCK_write && lock->owner != task);
 	EBUG_ON(type == SIX_LOCK_write && (lock->state.seq & 1));
 	EBUG_ON(type == SIX_LOCK_write && (try != !(lock->state.write_locking)));
@@ -122,18 +138,42 @@ static int __do_six_trylock_type(struct six_lock *lock,
 	 * the lock, then issues a full memory barrier, then reads from the
 	 * other thread's variable to check if the other thread thinks it has
 	 * the lock. If we raced, we backoff and retry/sleep.
+	 *
+	 * lock->readers may be switched by six_lock_pcpu_adapt() while we're
+	 * not holding the lock, so it's only read once here, with preemption
+	 * disabled - that's what lets six_lock_pcpu_adapt() free it after an
+	 * RCU grace period:
 	 */
 
-	if (type == SIX_LOCK_read && lock->readers) {
+	readers = NULL;
+	if (type == SIX_LOCK_read) {
 		preempt_disable();
-		this_cpu_inc(*lock->readers); /* signal that we own lock */
+		readers = READ_ONCE(lock->readers);
+		if (!readers)
+			preempt_enable();
+	}
+
+	if (type == SIX_LOCK_read && readers) {
+		this_cpu_inc(*readers); /* signal that we own lock */
 
 		smp_mb();
 
 		old.v = READ_ONCE(lock->state.v);
 		ret = !(old.v & l[type].lock_fail);
 
-		this_cpu_sub(*lock->readers, !ret);
+		/*
+		 * If the lock was switched out of percpu mode after we read
+		 * lock->readers, our count on the old counters doesn't exclude
+		 * writers - back off and retry with the new mode:
+		 */
+		smp_rmb();
+		if (ret && unlikely(READ_ONCE(lock->readers) != readers)) {
+			this_cpu_dec(*readers);
+			preempt_enable();
+			goto retry;
+		}
+
+		this_cpu_sub(*readers, !ret);
 		preempt_enable();
 
 		/*
@@ -176,10 +216,18 @@ static int __do_six_trylock_type(struct six_lock *lock,
 				ret = -1 - SIX_LOCK_read;
 		} else {
 			atomic64_add(v, &lock->state.counter);
+			/*
+			 * On success we just made seq odd: that's our acquire
+			 * barrier, for callers relying on seq alone (i.e.
+			 * six_lock_seq_begin()/six_lock_seq_retry()) not to see
+			 * our writes to the protected data before it:
+			 */
+			if (ret)
+				smp_mb__after_atomic();
 		}
 	} else {
 		v = READ_ONCE(lock->state.v);
-		do {
+		while (1) {
 			new.v = old.v = v;
 
 			if (!(old.v & l[type].lock_fail)) {
@@ -191,11 +239,40 @@ static int __do_six_trylock_type(struct six_lock *lock,
 				new.waiters |= 1 << type;
 			else
 				break; /* waiting bit already set */
-		} while ((v = atomic64_cmpxchg_acquire(&lock->state.counter,
-					old.v, new.v)) != old.v);
+
+			v = atomic64_cmpxchg_acquire(&lock->state.counter,
+						     old.v, new.v);
+			if (v == old.v)
+				break;
+
+			if (type == SIX_LOCK_read)
+				six_lock_read_contended(lock);
+		}
 
 		ret = !(old.v & l[type].lock_fail);
 
+		/*
+		 * Taking the write lock made seq odd; cmpxchg_acquire() only
+		 * orders its load, so as in write_seqcount_begin() we need a
+		 * barrier for six_lock_seq_begin()/six_lock_seq_retry() not to
+		 * see our writes to the protected data before the seq change:
+		 */
+		if (type == SIX_LOCK_write && ret)
+			smp_wmb();
+
+		/*
+		 * We raced with six_lock_pcpu_adapt() switching the lock into
+		 * percpu mode - percpu mode writers don't look at
+		 * state.read_lock, so drop the read lock we took and retry in
+		 * percpu mode (no wakeup needed, six_lock_wakeup() also ignores
+		 * state.read_lock in percpu mode):
+		 */
+		if (type == SIX_LOCK_read && ret &&
+		    unlikely(READ_ONCE(lock->readers))) {
+			atomic64_sub(l[type].lock_val, &lock->state.counter);
+			goto retry;
+		}
+
 		EBUG_ON(ret && !(lock->state.v & l[type].held_mask));
 	}
 
@@ -207,10 +284,17 @@ static int __do_six_trylock_type(struct six_lock *lock,
 	return ret;
 }
 
+/*
+ * Waiters are handed the lock directly: we take it on their behalf here, under
+ * wait_lock, before waking them up. The actual wakeups are batched up and
+ * issued after dropping wait_lock, so that the tasks we wake don't immediately
+ * contend on wait_lock with us:
+ */
 static inline void __six_lock_wakeup(struct six_lock *lock, enum six_lock_type lock_type)
 {
 	struct six_lock_waiter *w, *next;
 	struct task_struct *task;
+	DEFINE_WAKE_Q(wake_q);
 	bool saw_one;
 	int ret;
 again:
@@ -233,19 +317,25 @@ static inline void __six_lock_wakeup(struct six_lock *lock, enum six_lock_type l
 		__list_del(w->list.prev, w->list.next);
 		task = w->task;
 		/*
-		 * Do no writes to @w besides setting lock_acquired - otherwise
-		 * we would need a memory barrier:
+		 * Take a ref on @task before setting lock_acquired: once it's
+		 * set, the waiter may return and exit, and @w goes away with
+		 * it. The ref is handed off to the wake_q, as in
+		 * rwsem_mark_wake(); wake_q_add_safe() then wakes @task even if
+		 * it's already queued on someone else's wake_q:
 		 */
-		barrier();
-		w->lock_acquired = true;
-		wake_up_process(task);
+		get_task_struct(task);
+		smp_store_release(&w->lock_acquired, true);
+		wake_q_add_safe(&wake_q, task);
 	}
 
 	clear_bit(waitlist_bitnr(lock_type), (unsigned long *) &lock->state.v);
 unlock:
 	raw_spin_unlock(&lock->wait_lock);
 
+	wake_up_q(&wake_q);
+
 	if (ret < 0) {
+		wake_q_init(&wake_q);
 		lock_type = -ret - 1;
 		goto again;
 	}
@@ -255,7 +345,8 @@ static inline void six_lock_wakeup(struct six_lock *lock,
 				   union six_lock_state state,
 				   enum six_lock_type lock_type)
 {
-	if (lock_type == SIX_LOCK_write && state.read_lock)
+	if (lock_type == SIX_LOCK_write && state.read_lock &&
+	    !READ_ONCE(lock->readers))
 		return;
 
 	if (!(state.waiters & (1 << lock_type)))
@@ -298,19 +389,30 @@ static bool __six_relock_type(struct six_lock *lock, enum six_lock_type type,
 
 	EBUG_ON(type == SIX_LOCK_write);
 
-	if (type == SIX_LOCK_read &&
-	    lock->readers) {
+	/*
+	 * See __do_six_trylock_type() for why lock->readers is only read once,
+	 * with preemption disabled; we don't need to recheck it here because
+	 * switching reader modes requires a write lock, which changes seq:
+	 */
+	if (type == SIX_LOCK_read) {
+		unsigned __percpu *readers;
 		bool ret;
 
 		preempt_disable();
-		this_cpu_inc(*lock->readers);
+		readers = READ_ONCE(lock->readers);
+		if (!readers) {
+			preempt_enable();
+			goto atomic;
+		}
+
+		this_cpu_inc(*readers);
 
 		smp_mb();
 
 		old.v = READ_ONCE(lock->state.v);
 		ret = !(old.v & l[type].lock_fail) && old.seq == seq;
 
-		this_cpu_sub(*lock->readers, !ret);
+		this_cpu_sub(*readers, !ret);
 		preempt_enable();
 
 		/*
@@ -325,7 +427,7 @@ static bool __six_relock_type(struct six_lock *lock, enum six_lock_type type,
 
 		return ret;
 	}
-
+atomic:
 	v = READ_ONCE(lock->state.v);
 	do {
 		old.v = v;
@@ -344,6 +446,43 @@ static bool __six_relock_type(struct six_lock *lock, enum six_lock_type type,
 
 #ifdef CONFIG_LOCK_SPIN_ON_OWNER
 
+/* How long a writer spins waiting for readers to drain before sleeping: */
+#define SIX_WRITE_SPIN_NS	(10 * NSEC_PER_USEC)
+
+/*
+ * Only the intent holder can take a write lock, so there's at most one write
+ * waiter and no queue of spinners to manage. What it's waiting on is readers,
+ * and readers don't record an owner we could watch - so, since read side
+ * critical sections are expected to be short, bound the spin by time instead.
+ *
+ * The last reader to unlock takes the lock on our behalf via
+ * __six_lock_wakeup(), same as if we were sleeping:
+ */
+static inline bool six_optimistic_spin_write(struct six_lock *lock,
+					     struct six_lock_waiter *wait)
+{
+	unsigned loop = 0;
+	u64 end_time;
+
+	if (rt_task(current))
+		return false;
+
+	preempt_disable();
+	end_time = local_clock() + SIX_WRITE_SPIN_NS;
+
+	while (!READ_ONCE(wait->lock_acquired) && !need_resched()) {
+		if (!(++loop & 0xf) &&
+		    time_after64(local_clock(), end_time))
+			break;
+
+		cpu_relax();
+	}
+	preempt_enable();
+
+	/* Pairs with smp_store_release() in __six_lock_wakeup(): */
+	return smp_load_acquire(&wait->lock_acquired);
+}
+
 static inline bool six_optimistic_spin(struct six_lock *lock,
 				       struct six_lock_waiter *wait)
 {
@@ -357,7 +496,7 @@ static inline bool six_optimistic_spin(struct six_lock *lock,
 			return false;
 		break;
 	case SIX_LOCK_write:
-		return false;
+		return six_optimistic_spin_write(lock, wait);
 	}
 
 	rcu_read_lock();
@@ -376,7 +515,7 @@ static inline bool six_optimistic_spin(struct six_lock *lock,
 		 * If we're an RT task that will live-lock because we won't let
 		 * the owner complete.
 		 */
-		if (wait->lock_acquired ||
+		if (READ_ONCE(wait->lock_acquired) ||
 		    !owner->on_cpu ||
 		    rt_task(task) ||
 		    need_resched())
@@ -386,7 +525,8 @@ static inline bool six_optimistic_spin(struct six_lock *lock,
 	}
 	rcu_read_unlock();
 
-	return wait->lock_acquired;
+	/* Pairs with smp_store_release() in __six_lock_wakeup(): */
+	return smp_load_acquire(&wait->lock_acquired);
 }
 
 #else /* CONFIG_LOCK_SPIN_ON_OWNER */
@@ -415,6 +555,14 @@ static int __six_lock_type_slowpath(struct six_lock *lock, enum six_lock_type ty
 
 	lock_contended(&lock->dep_map, _RET_IP_);
 
+	/*
+	 * In percpu mode readers never contend with each other, so a reader
+	 * blocking on a writer is the only signal that the lock is still
+	 * read-hot - see six_lock_pcpu_adapt():
+	 */
+	if (type == SIX_LOCK_read && lock->readers)
+		six_lock_read_contended(lock);
+
 	wait->task		= current;
 	wait->lock_want		= type;
 	wait->lock_acquired	= false;
@@ -459,7 +607,8 @@ static int __six_lock_type_slowpath(struct six_lock *lock, enum six_lock_type ty
 	while (1) {
 		set_current_state(TASK_UNINTERRUPTIBLE);
 
-		if (wait->lock_acquired)
+		/* Pairs with smp_store_release() in __six_lock_wakeup(): */
+		if (smp_load_acquire(&wait->lock_acquired))
 			break;
 
 		ret = should_sleep_fn ? should_sleep_fn(lock, p) : 0;
@@ -728,6 +877,74 @@ void six_lock_pcpu_alloc(struct six_lock *lock)
 }
 EXPORT_SYMBOL_GPL(six_lock_pcpu_alloc);
 
+struct six_lock_pcpu_rcu {
+	struct rcu_head		rcu;
+	unsigned __percpu	*readers;
+};
+
+static void six_lock_pcpu_free_rcu_fn(struct rcu_head *rcu)
+{
+	struct six_lock_pcpu_rcu *p = container_of(rcu, struct six_lock_pcpu_rcu, rcu);
+
+	free_percpu(p->readers);
+	kfree(p);
+}
+
+/*
+ * Adaptive percpu reader mode:
+ *
+ * Percpu reader mode makes read locks scale, but it makes write locks more
+ * expensive (the writer has to sum every cpu's reader count) and it costs
+ * percpu memory - for locks like btree nodes, where only a few of them are ever
+ * read-hot, we'd rather pick the mode based on what the lock is actually
+ * seeing.
+ *
+ * lock->read_contended is a rough count of contended read locks: in normal mode
+ * it's bumped when a reader has to retry its cmpxchg on lock->state, in percpu
+ * mode when a reader has to wait on a writer. It's halved on every call here,
+ * i.e. every write lock, so it tracks contended reads per write: when it gets
+ * big enough we switch to percpu mode, and when it decays to zero in percpu mode
+ * the lock has gone write-hot and we switch back.
+ *
+ * Must be called with the lock held for write, which excludes all readers while
+ * we switch. Readers that raced and saw the old mode back off and retry; in
+ * percpu mode they do so with preemption disabled, so the old percpu counters
+ * are freed after an RCU grace period.
+ *
+ * Memory allocations here are GFP_NOWAIT, since the caller is holding btree
+ * locks: if they fail we just stay in the current mode.
+ */
+void six_lock_pcpu_adapt(struct six_lock *lock)
+{
+	unsigned contended = READ_ONCE(lock->read_contended);
+
+	EBUG_ON(!(lock->state.seq & 1));
+
+	if (!lock->readers) {
+		if (contended >= SIX_LOCK_PCPU_CONTENDED) {
+			unsigned __percpu *readers =
+				alloc_percpu_gfp(unsigned, GFP_NOWAIT|__GFP_NOWARN);
+
+			if (readers)
+				smp_store_release(&lock->readers, readers);
+		}
+	} else if (!contended &&
+		   /* a reader from normal mode may still be backing out: */
+		   !lock->state.read_lock) {
+		struct six_lock_pcpu_rcu *p =
+			kmalloc(sizeof(*p), GFP_NOWAIT|__GFP_NOWARN);
+
+		if (p) {
+			p->readers = lock->readers;
+			WRITE_ONCE(lock->readers, NULL);
+			call_rcu(&p->rcu, six_lock_pcpu_free_rcu_fn);
+		}
+	}
+
+	WRITE_ONCE(lock->read_contended, contended / 2);
+}
+EXPORT_SYMBOL_GPL(six_lock_pcpu_adapt);
+
 /*
  * Returns lock held counts, for both read and intent
  */
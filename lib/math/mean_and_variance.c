@@ -42,6 +42,7 @@
 #include <linux/math64.h>
 #include <linux/mean_and_variance.h>
 #include <linux/module.h>
+#include <linux/overflow.h>
 #include <linux/printbuf.h>
 
 
@@ -71,6 +72,48 @@ struct mean_and_variance mean_and_variance_update(struct mean_and_variance s1, s
 }
 EXPORT_SYMBOL_GPL(mean_and_variance_update);
 
+/**
+ * mean_and_variance_update_batch() - update a mean_and_variance struct @s1 with
+ * @nr new samples from @v and return it.
+ * @s1: the mean_and_variance to update.
+ * @v: the new samples.
+ * @nr: number of samples in @v.
+ *
+ * Equivalent to calling mean_and_variance_update() for each sample, but squares
+ * of samples that fit in 32 bits (the common case for latencies in ns) are
+ * summed with plain 64 bit arithmetic, and only added to the u128 sum of
+ * squares once per batch (or when the 64 bit sum would overflow).
+ */
+struct mean_and_variance mean_and_variance_update_batch(struct mean_and_variance s1,
+							 const s64 *v, unsigned nr)
+{
+	u64 sum_squares = 0;
+	unsigned i;
+
+	for (i = 0; i < nr; i++) {
+		u64 a = abs(v[i]);
+
+		s1.sum += v[i];
+
+		if (a <= SQRT_U64_MAX) {
+			u64 sq = a * a, new_sum;
+
+			if (check_add_overflow(sum_squares, sq, &new_sum)) {
+				s1.sum_squares = u128_add(s1.sum_squares, u64_to_u128(sum_squares));
+				new_sum = sq;
+			}
+			sum_squares = new_sum;
+		} else {
+			s1.sum_squares = u128_add(s1.sum_squares, u128_square(a));
+		}
+	}
+
+	s1.n += nr;
+	s1.sum_squares = u128_add(s1.sum_squares, u64_to_u128(sum_squares));
+	return s1;
+}
+EXPORT_SYMBOL_GPL(mean_and_variance_update_batch);
+
 /**
  * mean_and_variance_get_mean() - get mean from @s
  */
@@ -1,5 +1,6 @@
 // SPDX-License-Identifier: GPL-2.0
 #include <kunit/test.h>
+#include <linux/ktime.h>
 #include <linux/mean_and_variance.h>
 
 #define MAX_SQR (SQRT_U64_MAX*SQRT_U64_MAX)
@@ -135,12 +136,75 @@ static void mean_and_variance_u128_basic_test(struct kunit *test)
 	KUNIT_EXPECT_EQ(test, u128_to_u64(u128_div(u128_shl(u64_to_u128(U64_MAX), 32), 2)), U64_MAX << 31);
 }
 
+static void mean_and_variance_batch_test(struct kunit *test)
+{
+	s64 v[] = { 1, -2, 3, 1000, -1000000, SQRT_U64_MAX, -(s64) SQRT_U64_MAX,
+		    (s64) SQRT_U64_MAX + 1, 1LL << 40, -(1LL << 40), 7 };
+	struct mean_and_variance s1 = {}, s2 = {}, s3 = {};
+	struct mean_and_variance_buf b = {};
+	unsigned i, j;
+
+	for (j = 0; j < 8; j++)
+		for (i = 0; i < ARRAY_SIZE(v); i++) {
+			s1 = mean_and_variance_update(s1, v[i]);
+
+			if (mean_and_variance_buf_add(&b, v[i]))
+				mean_and_variance_buf_flush(&s3, &b);
+		}
+	mean_and_variance_buf_flush(&s3, &b);
+
+	for (j = 0; j < 8; j++)
+		s2 = mean_and_variance_update_batch(s2, v, ARRAY_SIZE(v));
+
+	KUNIT_EXPECT_EQ(test, s1.n, s2.n);
+	KUNIT_EXPECT_EQ(test, s1.sum, s2.sum);
+	KUNIT_EXPECT_EQ(test, u128_to_u64(s1.sum_squares), u128_to_u64(s2.sum_squares));
+	KUNIT_EXPECT_EQ(test, u128_shr64_to_u64(s1.sum_squares), u128_shr64_to_u64(s2.sum_squares));
+
+	KUNIT_EXPECT_EQ(test, s1.n, s3.n);
+	KUNIT_EXPECT_EQ(test, s1.sum, s3.sum);
+	KUNIT_EXPECT_EQ(test, u128_to_u64(s1.sum_squares), u128_to_u64(s3.sum_squares));
+	KUNIT_EXPECT_EQ(test, u128_shr64_to_u64(s1.sum_squares), u128_shr64_to_u64(s3.sum_squares));
+}
+
+/*
+ * Not a correctness test: reports the per sample cost of single vs. batched
+ * updates, with latency-like (sub 32 bit) samples:
+ */
+static void mean_and_variance_batch_bench(struct kunit *test)
+{
+	struct mean_and_variance s1 = {}, s2 = {};
+	struct mean_and_variance_buf b = {};
+	unsigned i, nr = 1U << 20;
+	u64 start, single_ns, batch_ns;
+
+	start = ktime_get_ns();
+	for (i = 0; i < nr; i++)
+		s1 = mean_and_variance_update(s1, i & 0xfffff);
+	single_ns = ktime_get_ns() - start;
+
+	start = ktime_get_ns();
+	for (i = 0; i < nr; i++)
+		if (mean_and_variance_buf_add(&b, i & 0xfffff))
+			mean_and_variance_buf_flush(&s2, &b);
+	mean_and_variance_buf_flush(&s2, &b);
+	batch_ns = ktime_get_ns() - start;
+
+	KUNIT_EXPECT_EQ(test, s1.sum, s2.sum);
+
+	kunit_info(test, "per sample: single %llu ps, batched %llu ps\n",
+		   div_u64(single_ns * 1000, nr),
+		   div_u64(batch_ns * 1000, nr));
+}
+
 static struct kunit_case mean_and_variance_test_cases[] = {
 	KUNIT_CASE(mean_and_variance_fast_divpow2),
 	KUNIT_CASE(mean_and_variance_u128_basic_test),
 	KUNIT_CASE(mean_and_variance_basic_test),
 	KUNIT_CASE(mean_and_variance_weighted_test),
 	KUNIT_CASE(mean_and_variance_weighted_advanced_test),
+	KUNIT_CASE(mean_and_variance_batch_test),
+	KUNIT_CASE(mean_and_variance_batch_bench),
 	{}
 };
 